@@ -10,6 +10,7 @@ enum {
     reg_x,
     reg_y,
     reg_z,
+    reg_none, // Not specialized for a register
 };
 
 enum {
@@ -19,136 +20,173 @@ enum {
     flag_minus = 8,
 };
 
+// Operand kinds, see "Bytecode encoding" in the readme.
 enum {
-    ins_hlt, // Halt
-    ins_nop, // No-op
-
-    // Memory operations
-    ins_sta, // Store A in memory
-    ins_lda, // Load A from memory
-    ins_stx, // Store X in memory
-    ins_ldx, // Load X from memory
-    ins_sty, // Store Y in memory
-    ins_ldy, // Load Y from memory
-    ins_stz, // Store Z in memory
-    ins_ldz, // Load Z from memory
-
-    // Move operations
-    ins_max, // Move A -> X
-    ins_may, // Move A -> Y
-    ins_maz, // Move A -> Z
-    ins_mxa, // Move X -> A
-    ins_mya, // Move Y -> A
-    ins_mza, // Move Z -> A
-
-    // Set operations
-    ins_isa, // Immediate set A
-    ins_isx, // Immediate set X
-    ins_isy, // Immediate set Y
-    ins_isz, // Immediate set Z
-
-    // System operations
-    ins_int, // Interrupt
-    ins_ssp, // Set stack pointer (default: 0x1000);
-
-    // Stack operations
-    ins_pha, // Push A
-    ins_phx, // Push X
-    ins_phy, // Push Y
-    ins_phz, // Push Z
-    ins_pla, // Pull A
-    ins_plx, // Pull X
-    ins_ply, // Pull Y
-    ins_plz, // Pull Z
-
-    // Increment/Decrement operations
-    ins_inc, // Increment A
-    ins_inx, // Increment X
-    ins_iny, // Increment Y
-    ins_inz, // Increment Z
-    ins_dec, // Decrement A
-    ins_dex, // Decrement X
-    ins_dey, // Decrement Y
-    ins_dez, // Decrement Z
-
-    // Mathematical/Logical operations
-    ins_add, // Add to A
-    ins_sub, // Substract from A
-    ins_mul, // Multiply with A
-    ins_div, // Divide A
-    ins_and, // And with A
-    ins_ora, // Or with A
-    ins_xor, // X-Or with A
-    ins_nxr, // Not X-Or with A
-    ins_bit, // Bit test A
-    ins_rsh, // Right-shift A
-    ins_lsh, // Left-shift A
-    ins_addi, // Add to A
-    ins_subi, // Substract from A
-    ins_muli, // Multiply with A
-    ins_divi, // Divide A
-    ins_andi, // And with A
-    ins_orai, // Or with A
-    ins_xori, // X-Or with A
-    ins_nxri, // Not X-Or with A
-    ins_biti, // Bit test A
-    ins_rshi, // Right-shift A
-    ins_lshi, // Left-shift
-    ins_flag, // Bit-test FLAGS
-
-    // Unary arithmetic/logic operations
-    ins_neg, // Negate
-    ins_not, // Binary not
-
-    // Comparison operations
-    ins_cmp, // Compare A
-    ins_cpx, // Compare X
-    ins_cpy, // Compare Y
-    ins_cpz, // Compare Z
-    ins_cmpi, // Compare A
-    ins_cpxi, // Compare X
-    ins_cpyi, // Compare Y
-    ins_cpzi, // Compare Z
+    opr_none,  // No operand
+    opr_reg,   // Register number (8-bit, 0-3)
+    opr_byte,  // Immediate 8-bit number
+    opr_imm,   // Immediate 16-bit number
+    opr_mem,   // 16-bit data address, read
+    opr_dst,   // 16-bit data address, written
+    opr_stack, // 16-bit address for the stack pointer
+    opr_code,  // 16-bit code address (jump/call target)
+};
 
-    // Control flow operations
-    ins_jmp, // Unconditional jump
-    ins_jnz, // Jump if not equal to zero
-    ins_jez, // Jump if equal to zero
-    ins_jeq, // Jump if equal
-    ins_jne, // Jump if not equal
-    ins_jgt, // Jump if greater than
-    ins_jlt, // Jump if less than
+#define TINYLANG_OPR_LENGTH_none  0
+#define TINYLANG_OPR_LENGTH_reg   1
+#define TINYLANG_OPR_LENGTH_byte  1
+#define TINYLANG_OPR_LENGTH_imm   2
+#define TINYLANG_OPR_LENGTH_mem   2
+#define TINYLANG_OPR_LENGTH_dst   2
+#define TINYLANG_OPR_LENGTH_stack 2
+#define TINYLANG_OPR_LENGTH_code  2
+
+#define TINYLANG_FLAGS_CMP (flag_zero | flag_plus | flag_minus)
+
+// The instruction set, everything else about opcodes is generated from
+// this table, in this order:
+//   X(name, operand, register, flags written, handler, handler argument)
+// `handler` names the VM handler (`H_<handler>` in vm.c), which gets
+// the operand kind, the register and the argument as constants.
+#define TINYLANG_OPCODES(X)                                                \
+    X(hlt, none, reg_none, 0, halt, )      /* Halt */                      \
+    X(nop, none, reg_none, 0, nop, )       /* No-op */                     \
+                                                                           \
+    /* Memory operations */                                                \
+    X(sta, dst, reg_a, 0, store, )         /* Store A in memory */         \
+    X(lda, mem, reg_a, 0, load, )          /* Load A from memory */        \
+    X(stx, dst, reg_x, 0, store, )         /* Store X in memory */         \
+    X(ldx, mem, reg_x, 0, load, )          /* Load X from memory */        \
+    X(sty, dst, reg_y, 0, store, )         /* Store Y in memory */         \
+    X(ldy, mem, reg_y, 0, load, )          /* Load Y from memory */        \
+    X(stz, dst, reg_z, 0, store, )         /* Store Z in memory */         \
+    X(ldz, mem, reg_z, 0, load, )          /* Load Z from memory */        \
+                                                                           \
+    /* Move operations */                                                  \
+    X(max, none, reg_x, 0, from_a, )       /* Move A -> X */               \
+    X(may, none, reg_y, 0, from_a, )       /* Move A -> Y */               \
+    X(maz, none, reg_z, 0, from_a, )       /* Move A -> Z */               \
+    X(mxa, none, reg_x, 0, to_a, )         /* Move X -> A */               \
+    X(mya, none, reg_y, 0, to_a, )         /* Move Y -> A */               \
+    X(mza, none, reg_z, 0, to_a, )         /* Move Z -> A */               \
+                                                                           \
+    /* Set operations */                                                   \
+    X(isa, imm, reg_a, 0, set, )           /* Immediate set A */           \
+    X(isx, imm, reg_x, 0, set, )           /* Immediate set X */           \
+    X(isy, imm, reg_y, 0, set, )           /* Immediate set Y */           \
+    X(isz, imm, reg_z, 0, set, )           /* Immediate set Z */           \
+                                                                           \
+    /* System operations */                                                \
+    X(int, byte, reg_none, 0, todo, )      /* Interrupt */                 \
+    X(ssp, stack, reg_none, 0, ssp, )      /* Set stack pointer (default: 0x1000) */ \
+                                                                           \
+    /* Stack operations */                                                 \
+    X(pha, none, reg_a, 0, push, )         /* Push A */                    \
+    X(phx, none, reg_x, 0, push, )         /* Push X */                    \
+    X(phy, none, reg_y, 0, push, )         /* Push Y */                    \
+    X(phz, none, reg_z, 0, push, )         /* Push Z */                    \
+    X(pla, none, reg_a, 0, pull, )         /* Pull A */                    \
+    X(plx, none, reg_x, 0, pull, )         /* Pull X */                    \
+    X(ply, none, reg_y, 0, pull, )         /* Pull Y */                    \
+    X(plz, none, reg_z, 0, pull, )         /* Pull Z */                    \
+                                                                           \
+    /* Increment/Decrement operations */                                   \
+    X(inc, none, reg_a, 0, inc, )          /* Increment A */               \
+    X(inx, none, reg_x, 0, inc, )          /* Increment X */               \
+    X(iny, none, reg_y, 0, inc, )          /* Increment Y */               \
+    X(inz, none, reg_z, 0, inc, )          /* Increment Z */               \
+    X(dec, none, reg_a, 0, dec, )          /* Decrement A */               \
+    X(dex, none, reg_x, 0, dec, )          /* Decrement X */               \
+    X(dey, none, reg_y, 0, dec, )          /* Decrement Y */               \
+    X(dez, none, reg_z, 0, dec, )          /* Decrement Z */               \
+                                                                           \
+    /* Mathematical/Logical operations */                                  \
+    X(add, reg, reg_a, 0, alu, +)          /* Add to A */                  \
+    X(sub, reg, reg_a, 0, alu, -)          /* Substract from A */          \
+    X(mul, reg, reg_a, 0, alu, *)          /* Multiply with A */           \
+    X(div, reg, reg_a, 0, alu, /)          /* Divide A */                  \
+    X(and, reg, reg_a, 0, alu, &)          /* And with A */                \
+    X(ora, reg, reg_a, 0, alu, |)          /* Or with A */                 \
+    X(xor, reg, reg_a, 0, alu, ^)          /* X-Or with A */               \
+    X(nxr, reg, reg_a, 0, alu, ==)         /* Not X-Or with A */           \
+    X(bit, reg, reg_a, 0, todo, )          /* Bit test A */                \
+    X(rsh, reg, reg_a, 0, alu, >>)         /* Right-shift A */             \
+    X(lsh, reg, reg_a, 0, alu, <<)         /* Left-shift A */              \
+    X(addi, imm, reg_a, 0, alui, +)        /* Add to A */                  \
+    X(subi, imm, reg_a, 0, alui, -)        /* Substract from A */          \
+    X(muli, imm, reg_a, 0, alui, *)        /* Multiply with A */           \
+    X(divi, imm, reg_a, 0, alui, /)        /* Divide A */                  \
+    X(andi, imm, reg_a, 0, alui, &)        /* And with A */                \
+    X(orai, imm, reg_a, 0, alui, |)        /* Or with A */                 \
+    X(xori, imm, reg_a, 0, alui, ^)        /* X-Or with A */               \
+    X(nxri, imm, reg_a, 0, alui, ==)       /* Not X-Or with A */           \
+    X(biti, imm, reg_a, 0, todo, )         /* Bit test A */                \
+    X(rshi, imm, reg_a, 0, alui, >>)       /* Right-shift A */             \
+    X(lshi, imm, reg_a, 0, alui, <<)       /* Left-shift */                \
+    X(flag, imm, reg_none, 0, todo, )      /* Bit-test FLAGS */            \
+                                                                           \
+    /* Unary arithmetic/logic operations */                                \
+    X(neg, none, reg_a, 0, unary, !)       /* Negate */                    \
+    X(not, none, reg_a, 0, unary, ~)       /* Binary not */                \
+                                                                           \
+    /* Comparison operations */                                            \
+    X(cmp, reg, reg_a, TINYLANG_FLAGS_CMP, cmp, )  /* Compare A */         \
+    X(cpx, reg, reg_x, 0, todo, )          /* Compare X (deprecated?) */   \
+    X(cpy, reg, reg_y, 0, todo, )          /* Compare Y (deprecated?) */   \
+    X(cpz, reg, reg_z, 0, todo, )          /* Compare Z (deprecated?) */   \
+    X(cmpi, imm, reg_a, TINYLANG_FLAGS_CMP, cmpi, ) /* Compare A */        \
+    X(cpxi, imm, reg_x, 0, todo, )         /* Compare X (deprecated?) */   \
+    X(cpyi, imm, reg_y, 0, todo, )         /* Compare Y (deprecated?) */   \
+    X(cpzi, imm, reg_z, 0, todo, )         /* Compare Z (deprecated?) */   \
+                                                                           \
+    /* Control flow operations */                                          \
+    X(jmp, code, reg_none, 0, jmp, )       /* Unconditional jump */        \
+    X(jnz, code, reg_none, 0, todo_jump, ) /* Jump if not equal to zero */ \
+    X(jez, code, reg_none, 0, todo_jump, ) /* Jump if equal to zero */     \
+    X(jeq, code, reg_none, 0, todo_jump, ) /* Jump if equal */             \
+    X(jne, code, reg_none, 0, todo_jump, ) /* Jump if not equal */         \
+    X(jgt, code, reg_none, 0, todo_jump, ) /* Jump if greater than */      \
+    X(jlt, code, reg_none, 0, todo_jump, ) /* Jump if less than */         \
+                                                                           \
+    /* Subroutine operations */                                            \
+    X(ret, none, reg_none, 0, ret, )       /* Return from subroutine */    \
+    X(cll, code, reg_none, 0, cll, )       /* Call subroutine */           \
+    X(cla, reg, reg_none, 0, cla, )        /* Call subroutine at an address in register */
 
-    // Subroutine operations
-    ins_ret, // Return from subroutine
-    ins_cll, // Call subroutine
-    ins_cla, // Call subroutine at an address in register
+enum {
+#define X(N, KIND, REG, FLAGS, HANDLER, ARG) ins_##N,
+    TINYLANG_OPCODES(X)
+#undef X
 };
 
-// 81 instructions.
+#define TINYLANG_ONE_(N, KIND, REG, FLAGS, HANDLER, ARG) + 1
+#define TINYLANG_INS_COUNT (0 TINYLANG_OPCODES(TINYLANG_ONE_))
+
+typedef struct {
+    const char *name;
+    u8 operand; // opr_*
+    u8 length;  // Operand bytes
+    u8 reg;     // Register the instruction works on, reg_none if none
+    u8 flags;   // Flags the instruction writes
+} ins_info_t;
+
+static const ins_info_t ins_info[] = {
+#define X(N, KIND, REG, FLAGS, HANDLER, ARG) \
+    { #N, opr_##KIND, TINYLANG_OPR_LENGTH_##KIND, REG, FLAGS },
+    TINYLANG_OPCODES(X)
+#undef X
+};
 
 const char *ins_convert_to_string(u8 cp) {
-    static const char *map[] = {
-        "hlt", "nop", "sta", "lda", "stx", "ldx", "sty", "ldy", "stz", "ldz", "max", "may", "maz", "mxa", "mya", "mza", "isa", "isx", "isy", "isz",
-        "int", "ssp", "pha", "phx", "phy", "phz", "pla", "plx", "ply", "plz", "inc", "inx", "iny", "inz", "dec", "dex", "dey", "dez", "add", "sub",
-        "mul", "div", "and", "ora", "xor", "nxr", "bit", "rsh", "lsh", "addi", "subi", "muli", "divi", "andi", "orai", "xori", "nxri", "biti",
-        "rshi", "lshi", "flag", "neg", "not", "cmp", "cpx", "cpy", "cpz",
-        "cmpi", "cpxi", "cpyi", "cpzi", "jmp", "jnz", "jez", "jeq", "jne",
-        "jgt", "jlt", "ret", "cll", "cla",
-    };
-    return map[cp];
+    return cp < TINYLANG_INS_COUNT ? ins_info[cp].name : "???";
 }
 
 u8 ins_length(u8 cp) {
-    static u8 map[] = {
-        0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2,
-        1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-        2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 0, 2, 1,
-    };
-    return map[cp];
+    return cp < TINYLANG_INS_COUNT ? ins_info[cp].length : 0;
 }
 
-
+u8 ins_operand(u8 cp) {
+    return cp < TINYLANG_INS_COUNT ? ins_info[cp].operand : opr_none;
+}
 
 #endif // TINYLANG_BYTECODE_HEADER_
@@ -4,6 +4,8 @@
 
 typedef uint8_t u8;
 typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
 typedef size_t usz;
 
 typedef u8 u1;
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/stat.h>
 #include "bytecode.h"
 #include "common.h"
 
@@ -27,9 +29,9 @@ const char *tok_to_str(token_t *t) {
 }
 
 token_t NIL_TOK = { 0, 0 };
+static char overlook = 0;
 token_t tnext(FILE *f) {
     token_t tok = NIL_TOK;
-    static char overlook = 0;
 again:;
     int c = overlook == 0 ? fgetc(f) : overlook;
     overlook = 0;
@@ -91,19 +93,32 @@ const char *parse_type_convert_to_string(u8 type) {
 static const u8 *debug_buf;
 static u16 debug_base = 0xA000;
 
+// End of the code buffer, emitters write nothing past it.
+static u8 *code_end;
+static u1 code_full = 0;
+
+u16 emit_overflow(void) {
+    if(!code_full) error("Code segment full!");
+    code_full = 1;
+    return 0;
+}
+
 #define O1(F) (debug_base + (u16)((F) - debug_buf))
 u16 emit0(u8 *f, u8 opc) {
+    if(f + 1 > code_end) return emit_overflow();
     *f++ = opc;
     return 1;
 }
 
 u16 emit1(u8 *f, u8 opc, u8 opr) {
+    if(f + 2 > code_end) return emit_overflow();
     *f++ = opc;
     *f++ = opr;
     return 2;
 }
 
 u16 emit2(u8 *f, u8 opc, u16 opr) {
+    if(f + 3 > code_end) return emit_overflow();
     *f++ = opc;
     *f++ = opr & 0xFF;
     *f++ = (opr & 0xFF00) >> 8;
@@ -117,7 +132,7 @@ u16 print_instr(u8 *f) {
         fprintf(stderr, "%.2X: \033[0;32m%s[%.2Xh]\033[0;0m\n", O1(f), ins_convert_to_string(opc), opc);
     } else if(len == 1) {
         u8 opr = *f++;
-        if(opc >= 0x26 && opc <= 0x30) {
+        if(ins_operand(opc) == opr_reg) {
             static const char regs[] = "AXYZ";
             fprintf(stderr, "%.2X: \033[0;32m%s[%.2Xh] \033[0;33m%c\033[0;0m\n",
                 O1(f), ins_convert_to_string(opc), opc, regs[opr]);
@@ -127,8 +142,9 @@ u16 print_instr(u8 *f) {
         }
     } else if(len == 2) {
         u16 opr = *f++;
-        opr |= (*f++) >> 8;
-        if((opc >= 0x02 && opc <= 0x09) || (opc >= 71 && opc <= 77)) {
+        opr |= (*f++) << 8;
+        if(ins_operand(opc) == opr_mem || ins_operand(opc) == opr_dst
+        || ins_operand(opc) == opr_stack || ins_operand(opc) == opr_code) {
             fprintf(stderr, "%.2X: \033[0;32m%s[%.2Xh] \033[0;33m0x%.4X\033[0;0m\n",
                 O1(f), ins_convert_to_string(opc), opc, opr);
         } else {
@@ -141,6 +157,11 @@ u16 print_instr(u8 *f) {
 
 #define VAR_COUNT 52
 
+// a-z are 0-25, A-Z are 26-51.
+usz var_index(char n) {
+    return n >= 'a' && n <= 'z' ? n - 'a' : n - 'A' + 26;
+}
+
 typedef struct {
     FILE *f;
     u8 *o, *r;
@@ -174,7 +195,7 @@ again:
                 else if(t.value == 'F')
                     info->o += emit2(info->o, ins_isa, TINYLANG_CONST_FALSE);
                 else
-                    info->o += emit2(info->o, ins_lda, info->vars[(usz)n]);
+                    info->o += emit2(info->o, ins_lda, info->vars[var_index(n)]);
             }
         } else if(t.type == token_type_num) {
             info->o += emit2(info->o, ins_isa, t.value);
@@ -193,7 +214,7 @@ again:
         info->type = parse_type_expr;
         info->prev = NIL_TOK;
         codegen(info);
-        info->o += emit2(info->o, ins_sta, info->vars[(usz)n] = info->last);
+        info->o += emit2(info->o, ins_sta, info->vars[var_index(n)] = info->last);
         info->last += 2;
         break;
     case parse_type_fact:
@@ -245,7 +266,7 @@ again:
             info->o += emit0(info->o, ins_max);
             info->o += emit0(info->o, ins_pla);
             info->o += emit1(info->o, ins_cmp, reg_x);
-            info->o += emit1(info->o, ins_biti, n == '>' ? flag_plus : flag_minus);
+            info->o += emit2(info->o, ins_biti, n == '>' ? flag_plus : flag_minus);
         }
         break;
     case parse_type_eqls:
@@ -302,12 +323,273 @@ again:
     }
 }
 
+// Watch mode keeps the code of every top-level statement together with
+// the variables it was compiled with. A statement is only recompiled if
+// its text changed or one of the variables it uses became (un)defined,
+// otherwise its old code is copied to the new address and its data
+// addresses are moved to where those variables live now.
+typedef struct {
+    char *src;
+    usz len;
+    u32 hash;
+    u64 uses;                          // Bit N set if the text mentions vars[N]
+    u16 vars[VAR_COUNT], last;         // Before the statement
+    u16 out_vars[VAR_COUNT], out_last; // After the statement
+    u16 base;                          // Address the code was generated at
+    u8 *code;
+    u16 size;
+} stmt_cache_t;
+
+// Length of the top-level statement at `s`, including its ';'.
+usz stmt_length(const char *s, usz len) {
+    int depth = 0;
+    for(usz i = 0; i < len; ++i) {
+        /**/ if(s[i] == '(' || s[i] == '{') ++depth;
+        else if(s[i] == ')' || s[i] == '}') --depth;
+        else if(s[i] == ';' && depth <= 0) return i + 1;
+    }
+    return len;
+}
+
+u32 stmt_hash(const char *s, usz len) {
+    u32 h = 2166136261u;
+    for(usz i = 0; i < len; ++i)
+        h = (h ^ (u8)s[i]) * 16777619u;
+    return h;
+}
+
+// Variables the statement at `s` may read or assign.
+u64 stmt_uses(const char *s, usz len) {
+    u64 uses = 0;
+    for(usz i = 0; i < len; ++i)
+        if((s[i] >= 'a' && s[i] <= 'z') || (s[i] >= 'A' && s[i] <= 'Z'))
+            uses |= (u64)1 << var_index(s[i]);
+    return uses;
+}
+
+// Whether the cached statement `c` reads the same variables now as when
+// it was compiled, only their slots may have moved.
+int stmt_compatible(const stmt_cache_t *c, const parser_info_t *info) {
+    for(usz v = 0; v < VAR_COUNT; ++v)
+        if((c->uses >> v & 1) && (c->vars[v] == 0) != (info->vars[v] == 0))
+            return 0;
+    return 1;
+}
+
+// Patches data addresses in code copied from the cached statement `c`:
+// slots the statement allocated itself move with `last`, the others
+// belong to a variable it uses and move to that variable's slot now.
+// Returns 1 if an address can not be mapped.
+int relocate_data(u8 *code, const stmt_cache_t *c, const parser_info_t *info) {
+    for(u16 a = 0; a < c->size; a += 1 + ins_length(code[a])) {
+        if(ins_operand(code[a]) != opr_mem && ins_operand(code[a]) != opr_dst) continue;
+        u16 d = code[a + 1] | (code[a + 2] << 8);
+        if(d >= c->last) {
+            d = d - c->last + info->last;
+        } else if(d != 0) {
+            usz v = 0;
+            while(v < VAR_COUNT && !((c->uses >> v & 1) && c->vars[v] == d)) ++v;
+            if(v == VAR_COUNT) return 1;
+            d = info->vars[v];
+        }
+        code[a + 1] = d & 0xFF;
+        code[a + 2] = (d & 0xFF00) >> 8;
+    }
+    return 0;
+}
+
+// Patches jump/call targets in code moved from `from` to `to`,
+// only targets inside the moved code (or right after it) are changed.
+void relocate(u8 *code, u16 size, u16 from, u16 to) {
+    for(u16 a = 0; a < size; a += 1 + ins_length(code[a])) {
+        if(ins_operand(code[a]) != opr_code) continue;
+        u16 t = code[a + 1] | (code[a + 2] << 8);
+        if(t < from || t > from + size) continue;
+        t = t - from + to;
+        code[a + 1] = t & 0xFF;
+        code[a + 2] = (t & 0xFF00) >> 8;
+    }
+}
+
+int watch(const char *in_path, const char *out_path) {
+    static u8 buf[0x10000 - 0xA000];
+    debug_buf = buf;
+    code_end = buf + sizeof(buf);
+
+    stmt_cache_t *cache = NULL;
+    usz count = 0;
+    struct timespec mtime = { 0, 0 };
+
+    for(;;) {
+        struct stat st;
+        if(stat(in_path, &st) != 0
+        || (st.st_mtim.tv_sec == mtime.tv_sec && st.st_mtim.tv_nsec == mtime.tv_nsec)) {
+            struct timespec poll = { 0, 100 * 1000 * 1000 };
+            nanosleep(&poll, NULL);
+            continue;
+        }
+        mtime = st.st_mtim;
+
+        FILE *in = fopen(in_path, "r");
+        if(!in) {
+            error("Failed opening file!");
+            continue;
+        }
+        char *src = malloc(st.st_size + 1);
+        usz len = fread(src, 1, st.st_size, in);
+        fclose(in);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        parser_info_t info;
+        info.o = info.r = buf;
+        info.last = 0x2000;
+        info.prev = NIL_TOK;
+        info.type = 0;
+        info.base = 0xA000;
+        for(u8 i = 0; i < VAR_COUNT; ++i)
+            info.vars[i] = 0;
+        error_count = 0;
+        code_full = 0;
+
+        stmt_cache_t *next = NULL;
+        usz next_count = 0, next_cap = 0, stmts = 0, reused = 0;
+
+        // Open addressing on the statement hash, slots hold index + 1.
+        usz mask = 63;
+        while(mask < count * 2) mask = mask * 2 + 1;
+        usz *index = calloc(mask + 1, sizeof(usz));
+        for(usz j = 0; j < count; ++j) {
+            usz k = cache[j].hash & mask;
+            while(index[k]) k = (k + 1) & mask;
+            index[k] = j + 1;
+        }
+
+        for(usz i = 0; i < len;) {
+            if(src[i] == ' ' || src[i] == '\n' || src[i] == '\t' || src[i] == '\r') {
+                ++i;
+                continue;
+            }
+            const char *s = src + i;
+            usz l = stmt_length(s, len - i);
+            u32 h = stmt_hash(s, l);
+            i += l;
+            ++stmts;
+
+            stmt_cache_t *c = NULL;
+            for(usz k = h & mask; index[k] && !c; k = (k + 1) & mask) {
+                usz j = index[k] - 1;
+                if(cache[j].code && cache[j].hash == h && cache[j].len == l
+                && memcmp(cache[j].src, s, l) == 0 && stmt_compatible(&cache[j], &info))
+                    c = &cache[j];
+            }
+
+            if(next_count == next_cap) {
+                next_cap = next_cap ? next_cap * 2 : 64;
+                next = realloc(next, next_cap * sizeof(stmt_cache_t));
+            }
+
+            u16 base = (u16)(info.o - info.r) + info.base;
+            if(c && info.o + c->size > code_end) {
+                emit_overflow();
+                break;
+            }
+            if(c) memcpy(info.o, c->code, c->size);
+            if(c && relocate_data(info.o, c, &info) == 0) {
+                relocate(info.o, c->size, c->base, base);
+                info.o += c->size;
+                for(usz v = 0; v < VAR_COUNT; ++v)
+                    if((c->uses >> v & 1) && c->out_vars[v] != c->vars[v])
+                        info.vars[v] = c->out_vars[v] - c->last + info.last;
+                info.last += c->out_last - c->last;
+                next[next_count++] = *c;
+                c->code = NULL; // Moved to `next`.
+                ++reused;
+                continue;
+            }
+
+            stmt_cache_t *n = &next[next_count];
+            memcpy(n->vars, info.vars, sizeof(info.vars));
+            n->last = info.last;
+
+            u1 errors = error_count;
+            info.f = fmemopen((void *)s, l, "r");
+            overlook = 0;
+            info.prev = NIL_TOK;
+            info.type = parse_type_stmt;
+            codegen(&info);
+            fclose(info.f);
+            if(code_full) break;
+            if(errors != error_count) continue;
+
+            n->src = malloc(l);
+            memcpy(n->src, s, l);
+            n->len = l;
+            n->hash = h;
+            n->uses = stmt_uses(s, l);
+            memcpy(n->out_vars, info.vars, sizeof(info.vars));
+            n->out_last = info.last;
+            n->base = base;
+            n->size = (u16)(info.o - info.r) + info.base - base;
+            n->code = malloc(n->size);
+            memcpy(n->code, info.o - n->size, n->size);
+            ++next_count;
+        }
+        info.o += emit0(info.o, ins_hlt);
+        free(index);
+        free(src);
+
+        for(usz j = 0; j < count; ++j) {
+            if(!cache[j].code) continue;
+            free(cache[j].code);
+            free(cache[j].src);
+        }
+        free(cache);
+        cache = next;
+        count = next_count;
+
+        if(code_full) {
+            fprintf(stderr, "Failed to compile due to %d errors, %s not written.\n",
+                error_count, out_path);
+            continue;
+        }
+
+        // Written next to `out_path` and renamed over it, so a VM
+        // started mid-rebuild never loads a half-written image.
+        char tmp_path[4096];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+        FILE *out = fopen(tmp_path, "wb");
+        if(!out) {
+            error("Failed opening file!");
+            continue;
+        }
+        fwrite(info.r, 1, info.o - info.r, out);
+        fclose(out);
+        if(rename(tmp_path, out_path) != 0) {
+            error("Failed replacing output file!");
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        if(error_count != 0)
+            fprintf(stderr, "Failed to compile due to %d errors.\n", error_count);
+        fprintf(stderr, "Rebuilt in %.3f ms, %zu of %zu statements reused.\n", ms, reused, stmts);
+    }
+}
+
 void usage(const char *pname) {
-    printf("Usage:\n\t%s <input.tl> <output.bin>", pname);
+    printf("Usage:\n\t%s [-w] <input.tl> <output.bin>\n"
+        "\t-w: watch <input.tl> and recompile changed statements\n", pname);
 }
 
 int main(int argc, char *argv[]) {
     if(argc < 3) return usage(argv[0]), 1;
+    if(strcmp(argv[1], "-w") == 0) {
+        if(argc < 4) return usage(argv[0]), 1;
+        return watch(argv[2], argv[3]);
+    }
     FILE *in = fopen(argv[1], "r");
     if(!in) {
         error("Failed opening file!");
@@ -316,6 +598,7 @@ int main(int argc, char *argv[]) {
 
     u8 buf[0x10000 - 0xA000];
     debug_buf = buf;
+    code_end = buf + sizeof(buf);
 
     parser_info_t info;
     info.f = in;
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bytecode.h"
+#include "common.h"
+#include "trace.h"
+
+void usage(char *pname) {
+    printf("Usage:\n\t%s <trace.bin>\n", pname);
+}
+
+static trace_event_t events[TINYLANG_TRACE_SIZE];
+
+// Call tree, node 0 is the entry point.
+typedef struct {
+    u16 addr;
+    u32 calls;
+    int parent, child, next;
+} call_node_t;
+static call_node_t nodes[TINYLANG_TRACE_SIZE + 1];
+static int node_count = 1;
+
+// A loop is a backward branch from `tail` to `head`.
+typedef struct {
+    u16 head, tail;
+    u32 count;
+} loop_t;
+static loop_t loops[TINYLANG_TRACE_SIZE];
+static int loop_count = 0;
+
+int call_enter(int parent, u16 addr) {
+    int n;
+    for(n = nodes[parent].child; n; n = nodes[n].next)
+        if(nodes[n].addr == addr) break;
+    if(!n) {
+        n = node_count++;
+        nodes[n].addr = addr;
+        nodes[n].parent = parent;
+        nodes[n].next = nodes[parent].child;
+        nodes[parent].child = n;
+    }
+    ++nodes[n].calls;
+    return n;
+}
+
+void call_print(int n, int depth) {
+    for(int c = nodes[n].child; c; c = nodes[c].next) {
+        fprintf(stdout, "%*s%.4X x%u\n", depth * 2 + 2, "", nodes[c].addr, nodes[c].calls);
+        call_print(c, depth + 1);
+    }
+}
+
+void loop_record(u16 head, u16 tail) {
+    for(int l = 0; l < loop_count; ++l) {
+        if(loops[l].head == head && loops[l].tail == tail) {
+            ++loops[l].count;
+            return;
+        }
+    }
+    loops[loop_count].head = head;
+    loops[loop_count].tail = tail;
+    loops[loop_count++].count = 1;
+}
+
+int loop_compare(const void *a, const void *b) {
+    u32 x = ((const loop_t *)a)->count, y = ((const loop_t *)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void print_event(trace_event_t *e) {
+    static const char regs[] = "AXYZ";
+    fprintf(stdout, "%.4X: \033[0;32m%s[%.2Xh]\033[0;0m -> %.4X",
+        e->p, ins_convert_to_string(e->i), e->i, e->to);
+    for(u8 r = reg_a; r <= reg_z; ++r)
+        if(e->changed & (1 << r))
+            fprintf(stdout, " \033[0;33m%c=%d\033[0;0m", regs[r], e->regs[r]);
+    fputc('\n', stdout);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 2) return usage(argv[0]), 1;
+
+    FILE *f = fopen(argv[1], "rb");
+    if(!f) {
+        fprintf(stderr, "Failed opening %s\n", argv[1]);
+        return 1;
+    }
+
+    trace_header_t h;
+    if(fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, TINYLANG_TRACE_MAGIC, sizeof(h.magic)) != 0
+    || h.count > TINYLANG_TRACE_SIZE) {
+        fprintf(stderr, "%s is not a trace\n", argv[1]);
+        fclose(f);
+        return 1;
+    }
+    u32 count = fread(events, sizeof(trace_event_t), h.count, f);
+    fclose(f);
+
+    fprintf(stdout, "%u events (%u recorded)\n", count, h.total);
+    int call = 0;
+    for(u32 n = 0; n < count; ++n) {
+        trace_event_t *e = &events[n];
+        print_event(e);
+        switch(e->i) {
+        case ins_cll:
+        case ins_cla:
+            call = call_enter(call, e->to);
+            break;
+        case ins_ret:
+            // The ring may have dropped the matching call.
+            if(call) call = nodes[call].parent;
+            break;
+        default:
+            if(ins_operand(e->i) == opr_code && e->to <= e->p) loop_record(e->to, e->p);
+            break;
+        }
+    }
+
+    fprintf(stdout, "\nCall tree:\n  entry\n");
+    call_print(0, 1);
+
+    qsort(loops, loop_count, sizeof(loop_t), loop_compare);
+    fprintf(stdout, "\nHot loops:\n");
+    for(int l = 0; l < loop_count && l < 10; ++l) {
+        fprintf(stdout, "  %.4X <- %.4X: %u iterations\n",
+            loops[l].head, loops[l].tail, loops[l].count);
+    }
+
+    return 0;
+}
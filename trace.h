@@ -0,0 +1,25 @@
+#ifndef TINYLANG_TRACE_HEADER_
+#define TINYLANG_TRACE_HEADER_
+#include "common.h"
+
+// Number of events kept by the VM, must be a power of two.
+#define TINYLANG_TRACE_SIZE 4096
+#define TINYLANG_TRACE_MAGIC "TLTR"
+
+// One event per branch, call, return, halt or bad instruction.
+typedef struct {
+    u16 p;       // Address of the instruction
+    u16 to;      // Address execution continued at
+    u8 i;        // Opcode
+    u8 changed;  // Bit N set if register N changed since the previous event
+    u16 regs[4]; // Registers after the instruction
+} trace_event_t;
+
+// Dump file layout: this header, then `count` events, oldest first.
+typedef struct {
+    char magic[4];
+    u32 count; // Events in the file
+    u32 total; // Events recorded, including the ones overwritten
+} trace_header_t;
+
+#endif // TINYLANG_TRACE_HEADER_
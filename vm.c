@@ -1,188 +1,353 @@
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "bytecode.h"
 #include "common.h"
+#include "trace.h"
 
 void usage(char *pname) {
-    printf("Usage:\n\t%s <file.bin>\n", pname);
+    printf("Usage:\n\t%s [-t <trace.bin>] [-u] <file.bin>\n"
+        "\t-u: skip verification and run with per-instruction checks\n", pname);
 }
 
+// Single producer (the VM), the only other reader is the signal
+// handler, so publishing `total` after the event is written is enough.
+typedef struct
+{
+    u32 total;
+    u16 last[4];
+    int fd;
+    trace_event_t ev[TINYLANG_TRACE_SIZE];
+} trace_t;
+
 typedef struct
 {
     u16 regs[4];
     u16 p, s, f, r;
+    trace_t *trace; // NULL unless tracing
+    u16 code;       // Start of the code image
+    u8 starts[0x10000 / 8]; // Instruction boundaries, set by verify()
     u8 mem[0x10000];
 } vm_t;
 vm_t state;
+trace_t trace;
+
+void trace_record(trace_t *t, u16 p, u8 i, u16 to, const u16 *regs)
+{
+    trace_event_t *e = &t->ev[t->total & (TINYLANG_TRACE_SIZE - 1)];
+    e->p = p;
+    e->to = to;
+    e->i = i;
+    e->changed = 0;
+    for(u8 r = reg_a; r <= reg_z; ++r) {
+        if(regs[r] != t->last[r]) e->changed |= 1 << r;
+        e->regs[r] = t->last[r] = regs[r];
+    }
+    __atomic_store_n(&t->total, t->total + 1, __ATOMIC_RELEASE);
+}
+
+// Only uses write(2), so it can be called from a signal handler.
+void trace_dump(trace_t *t)
+{
+    u32 total = __atomic_load_n(&t->total, __ATOMIC_ACQUIRE);
+    u32 head = total & (TINYLANG_TRACE_SIZE - 1);
+    trace_header_t h = { .count = total, .total = total };
+    memcpy(h.magic, TINYLANG_TRACE_MAGIC, sizeof(h.magic));
+
+    lseek(t->fd, 0, SEEK_SET);
+    // `ev[head]` may be half written if we interrupted trace_record(),
+    // so a wrapped ring is dumped from the slot after it.
+    if(total >= TINYLANG_TRACE_SIZE) {
+        h.count = TINYLANG_TRACE_SIZE - 1;
+        if(write(t->fd, &h, sizeof(h)) != sizeof(h)) return;
+        if(write(t->fd, t->ev + head + 1, (TINYLANG_TRACE_SIZE - head - 1) * sizeof(trace_event_t)) < 0) return;
+    } else {
+        if(write(t->fd, &h, sizeof(h)) != sizeof(h)) return;
+    }
+    if(write(t->fd, t->ev, head * sizeof(trace_event_t)) < 0) return;
+}
+
+// SIGUSR1 takes a snapshot, SIGINT and SIGTERM dump and then terminate.
+void trace_signal(int sig)
+{
+    if(state.trace) trace_dump(state.trace);
+    if(sig == SIGUSR1) return;
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
 
 u16 get_word_before(vm_t *state, u16 addr)
 {
-    return (state->mem[addr - 2] | (state->mem[addr - 1] << 8));
+    return (state->mem[(u16)(addr - 2)] | (state->mem[(u16)(addr - 1)] << 8));
 }
 
-void run(vm_t *state)
+void put_word(vm_t *state, u16 addr, u16 value)
 {
+    state->mem[addr] = value & 0xFF;
+    state->mem[(u16)(addr + 1)] = (value & 0xFF00) >> 8;
+}
+
+// Walks the code image once and checks every instruction: the opcode
+// must be known, its operands must fit in the image, register operands
+// must be 0-3, stores and the stack must not target the code and
+// jump/call targets must land on an instruction boundary inside the
+// image. The boundaries are kept in `state->starts` so `ret`/`cla`,
+// whose targets are only known at runtime, can be checked against them.
+// Returns 0 if the image is safe to pass to `run_verified()`.
+int verify(vm_t *state, u16 base, u16 size)
+{
+    u8 *starts = state->starts;
+    memset(starts, 0, sizeof(state->starts));
+    state->code = base;
+    usz end = (usz)base + size;
+    u8 last = ins_hlt;
+
+#define O1(A) (starts[(A) >> 3] & (1 << ((A) & 7)))
+    for(usz a = base; a < end; a += 1 + ins_length(state->mem[a])) {
+        u8 i = state->mem[a];
+        if(i >= TINYLANG_INS_COUNT) {
+            fprintf(stderr, "Verifier: Bad Instruction %d at %.4zX\n", i, a);
+            return 1;
+        }
+        if(a + 1 + ins_length(i) > end) {
+            fprintf(stderr, "Verifier: Truncated %s at %.4zX\n", ins_convert_to_string(i), a);
+            return 1;
+        }
+        starts[a >> 3] |= 1 << (a & 7);
+        last = i;
+    }
+    // Past the image is zeroes (hlt), unless the image ends at 0xFFFF.
+    if(end == 0x10000 && last != ins_hlt) {
+        fprintf(stderr, "Verifier: Image filling the code segment must end with hlt\n");
+        return 1;
+    }
 
-#define W() (get_word_before(state, state->p += 2))
+    for(usz a = base; a < end; a += 1 + ins_length(state->mem[a])) {
+        u8 i = state->mem[a];
+        u16 opr = 0;
+        if(ins_length(i) >= 1) opr = state->mem[a + 1];
+        if(ins_length(i) == 2) opr |= state->mem[a + 2] << 8;
+        switch(ins_operand(i)) {
+        case opr_reg:
+            if(opr > reg_z) {
+                fprintf(stderr, "Verifier: Bad Register %d for %s at %.4zX\n",
+                    opr, ins_convert_to_string(i), a);
+                return 1;
+            }
+            break;
+        case opr_dst:
+            if(opr >= base) {
+                fprintf(stderr, "Verifier: %s into code (0x%.4X) at %.4zX\n",
+                    ins_convert_to_string(i), opr, a);
+                return 1;
+            }
+            break;
+        case opr_stack:
+            if(opr >= base) {
+                fprintf(stderr, "Verifier: Stack in code (0x%.4X) at %.4zX\n", opr, a);
+                return 1;
+            }
+            break;
+        case opr_code:
+            if(opr < base || opr >= end || !O1(opr)) {
+                fprintf(stderr, "Verifier: Bad target 0x%.4X for %s at %.4zX\n",
+                    opr, ins_convert_to_string(i), a);
+                return 1;
+            }
+            break;
+        }
+    }
+#undef O1
+    return 0;
+}
+
+// `checked` is a constant in both callers, so each gets its own copy
+// of the loop: the checked one validates register operands and faults
+// on operands running past 0xFFFF on every dispatch, the verified one
+// relies on `verify()` having done that once at load. The verified one
+// still checks the targets of `ret`/`cla` and that stack writes stay
+// below the code, which `verify()` cannot know.
+// Returns 0 on `hlt` and 1 on a fault.
+static inline __attribute__((always_inline))
+int run_impl(vm_t *state, const u1 checked)
+{
+
+#define W() ({ if(checked && state->p > 0xFFFD) goto bad_operand; get_word_before(state, state->p += 2); })
 #define H() (state->mem[state->p++])
+#define R() ({ u8 r_ = H(); if(checked && r_ > reg_z) goto bad_register; r_; })
+#define T() if(state->trace) trace_record(state->trace, at, i, state->p, state->regs)
+#define J() if(!checked && !(state->starts[state->p >> 3] & (1 << (state->p & 7)))) goto bad_target
+#define S(N) if(!checked && state->s + (N) >= state->code) goto bad_stack
+    u16 at;
+    u8 i;
     for(;;)
     {
         // printf("Regs: A %.2d, X %.2d Y %.2d, Z %.2d, F %.2d, R %.2d, S %.2d, P %.2d\n",
         //     state->regs[0], state->regs[1], state->regs[2], state->regs[3],
         //     state->f, state->r, state->s, state->p);
         // printf("Stack: %.2d, %.2d\n", state->mem[4098], state->mem[4100]);
-        u8 i = state->mem[state->p++];
+        at = state->p;
+        i = state->mem[state->p++];
         // printf("\033[0;32m%s\033[0;0m\n", ins_convert_to_string(i));
         switch(i) {
-        case ins_hlt: return; // Halt
-        case ins_nop: break; // No-op
-
-#define O1(R) state->mem[W()] = state->regs[R]
-#define O2(R) state->regs[R] = state->mem[W()]
-        // Memory operations
-        case ins_sta: O1(reg_a); break; // Store A in memory
-        case ins_lda: O2(reg_a); break; // Load A from memory
-        case ins_stx: O1(reg_x); break; // Store X in memory
-        case ins_ldx: O2(reg_x); break; // Load X from memory
-        case ins_sty: O1(reg_y); break; // Store Y in memory
-        case ins_ldy: O2(reg_y); break; // Load Y from memory
-        case ins_stz: O1(reg_z); break; // Store Z in memory
-        case ins_ldz: O2(reg_z); break; // Load Z from memory
-#undef O1
-#undef O2
-#define O1(SRC,DST) state->regs[DST] = state->regs[SRC]
-        // Move operations
-        case ins_max: O1(reg_a, reg_x); break; // Move A -> X
-        case ins_may: O1(reg_a, reg_y); break; // Move A -> Y
-        case ins_maz: O1(reg_a, reg_z); break; // Move A -> Z
-        case ins_mxa: O1(reg_x, reg_a); break; // Move X -> A
-        case ins_mya: O1(reg_y, reg_a); break; // Move Y -> A
-        case ins_mza: O1(reg_z, reg_a); break; // Move Z -> A
-#undef O1
-#define O1(R) state->regs[R] = W()
-        // Set operations
-        case ins_isa: O1(reg_a); break; // Immediate set A
-        case ins_isx: O1(reg_x); break; // Immediate set X
-        case ins_isy: O1(reg_y); break; // Immediate set Y
-        case ins_isz: O1(reg_z); break; // Immediate set Z
-#undef O1
-        // System operations
-        case ins_int: /* todo */ break; // Interrupt
-        case ins_ssp: state->s = W(); break; // Set stack pointer (default: 0x1000);
-
-#define O1(R) state->mem[state->s] = state->regs[R]; state->s += 2
-#define O2(R) state->regs[R] = state->mem[state->s -= 2];
-        // Stack operations
-        case ins_pha: O1(reg_a); break; // Push A
-        case ins_phx: O1(reg_x); break; // Push X
-        case ins_phy: O1(reg_y); break; // Push Y
-        case ins_phz: O1(reg_z); break; // Push Z
-        case ins_pla: O2(reg_a); break; // Pull A
-        case ins_plx: O2(reg_x); break; // Pull X
-        case ins_ply: O2(reg_y); break; // Pull Y
-        case ins_plz: O2(reg_z); break; // Pull Z
-#undef O1
-#undef O2
-#define O1(R) ++state->regs[R];
-#define O2(R) --state->regs[R];
-        // Increment/Decrement operations
-        case ins_inc: O1(reg_a); break; // Increment A
-        case ins_inx: O1(reg_x); break; // Increment X
-        case ins_iny: O1(reg_y); break; // Increment Y
-        case ins_inz: O1(reg_z); break; // Increment Z
-        case ins_dec: O2(reg_a); break; // Decrement A
-        case ins_dex: O2(reg_x); break; // Decrement X
-        case ins_dey: O2(reg_y); break; // Decrement Y
-        case ins_dez: O2(reg_z); break; // Decrement Z
+// One handler per row of TINYLANG_OPCODES, the operand kind, register
+// and argument are constants so every case is specialized.
+#define S_none()
+#define S_reg()  (void)R()
+#define S_byte() (void)H()
+#define S_imm()  W()
+#define S_mem()  W()
+#define S_dst()  W()
+#define S_stack() W()
+#define S_code() W()
+#define H_halt(KIND, REG, ARG) T(); return 0
+#define H_nop(KIND, REG, ARG)
+#define H_todo(KIND, REG, ARG) S_##KIND()
+#define H_todo_jump(KIND, REG, ARG) W(); T()
+#define H_store(KIND, REG, ARG) state->mem[W()] = state->regs[REG]
+#define H_load(KIND, REG, ARG) state->regs[REG] = state->mem[W()]
+#define H_from_a(KIND, REG, ARG) state->regs[REG] = state->regs[reg_a]
+#define H_to_a(KIND, REG, ARG) state->regs[reg_a] = state->regs[REG]
+#define H_set(KIND, REG, ARG) state->regs[REG] = W()
+#define H_ssp(KIND, REG, ARG) state->s = W()
+#define H_push(KIND, REG, ARG) S(0); state->mem[state->s] = state->regs[REG]; state->s += 2
+#define H_pull(KIND, REG, ARG) state->regs[REG] = state->mem[state->s -= 2]
+#define H_inc(KIND, REG, ARG) ++state->regs[REG]
+#define H_dec(KIND, REG, ARG) --state->regs[REG]
+#define H_alu(KIND, REG, ARG) state->regs[REG] = state->regs[REG] ARG state->regs[R()]
+#define H_alui(KIND, REG, ARG) state->regs[REG] = state->regs[REG] ARG W()
+#define H_unary(KIND, REG, ARG) state->regs[REG] = ARG state->regs[REG]
+#define O1(REG, V) { /* tmp, for speed */ int x=(int)state->regs[REG]-(int)V;state->f|=x>0?flag_plus:flag_minus;state->f|=x^0?0:flag_zero;}
+#define H_cmp(KIND, REG, ARG) O1(REG, state->regs[R()])
+#define H_cmpi(KIND, REG, ARG) O1(REG, W())
+#define H_jmp(KIND, REG, ARG) state->p = W(); T()
+// Call frames hold the caller's R and the return address as full words.
+#define H_ret(KIND, REG, ARG) \
+            state->p = get_word_before(state, state->r + 2); \
+            state->s = state->r - 2; \
+            state->r = get_word_before(state, state->s + 2); \
+            J(); \
+            T()
+#define H_cll(KIND, REG, ARG) { \
+            u16 m = W(); \
+            S(3); \
+            put_word(state, state->s, state->r); \
+            state->s += 2; \
+            put_word(state, state->s, state->p); \
+            state->s += 2; \
+            state->r = state->s - 2; \
+            state->p = m; \
+            T(); }
+#define H_cla(KIND, REG, ARG) { \
+            u16 m = state->regs[R()]; \
+            S(3); \
+            put_word(state, state->s, state->r); \
+            state->s += 2; \
+            put_word(state, state->s, state->p); \
+            state->s += 2; \
+            state->r = state->s - 2; \
+            state->p = m; \
+            J(); \
+            T(); }
+#define X(N, KIND, REG, FLAGS, HANDLER, ARG) \
+        case ins_##N: H_##HANDLER(KIND, REG, ARG); break;
+        TINYLANG_OPCODES(X)
+#undef X
 #undef O1
-#undef O2
-#define O1(O) state->regs[0] = state->regs[0] O state->regs[H()]
-#define O2(O) state->regs[0] = state->regs[0] O W()
-        // Mathematical/Logical operations
-        case ins_add: O1(+); break; // Add to A
-        case ins_sub: O1(-); break; // Substract from A
-        case ins_mul: O1(*); break; // Multiply with A
-        case ins_div: O1(/); break; // Divide A
-        case ins_and: O1(&); break; // And with A
-        case ins_ora: O1(|); break; // Or with A
-        case ins_xor: O1(^); break; // X-Or with A
-        case ins_nxr: O1(==); break; // Not X-Or with A
-        case ins_bit: /* todo */ break; // Bit test A
-        case ins_rsh: O1(>>); break; // Right-shift A
-        case ins_lsh: O1(<<); break; // Left-shift A
-        case ins_addi: O2(+); break; // Add to A
-        case ins_subi: O2(-); break; // Substract from A
-        case ins_muli: O2(*); break; // Multiply with A
-        case ins_divi: O2(/); break; // Divide A
-        case ins_andi: O2(&); break; // And with A
-        case ins_orai: O2(|); break; // Or with A
-        case ins_xori: O2(^); break; // X-Or with A
-        case ins_nxri: O2(==); break; // Not X-Or with A
-        case ins_biti: /* todo */ break; // Bit test A
-        case ins_rshi: O2(>>); break; // Right-shift A
-        case ins_lshi: O2(<<); break; // Left-shift
-        case ins_flag: /* todo */ break; // Bit-test FLAGS
-#undef O1
-#undef O2
-#define O1(O) state->regs[0] = O state->regs[0]
-
-        // Unary arithmetic/logic operations
-        case ins_neg: O1(!); break; // Negate
-        case ins_not: O1(~); break; // Binary not
-#undef O1
-#define O1(V) { /* tmp, for speed */ int x=(int)state->regs[0]-(int)V;state->f|=x>0?flag_plus:flag_minus;state->f|=x^0?0:flag_zero;}
-        // Comparison operations
-        case ins_cmp: O1(state->regs[H()]); break; // Compare A
-        case ins_cpx: /* deprecated? */ break; // Compare X
-        case ins_cpy: /* deprecated? */ break; // Compare Y
-        case ins_cpz: /* deprecated? */ break; // Compare Z
-        case ins_cmpi: O1(W()); break; // Compare A
-        case ins_cpxi: /* deprecated? */ break; // Compare X
-        case ins_cpyi: /* deprecated? */ break; // Compare Y
-        case ins_cpzi: /* deprecated? */ break; // Compare Z
-
-        // Control flow operations
-        case ins_jmp: state->p = W(); break; // Unconditional jump
-        case ins_jnz: /* todo */ break; // Jump if not equal to zero
-        case ins_jez: /* todo */ break; // Jump if equal to zero
-        case ins_jeq: /* todo */ break; // Jump if equal
-        case ins_jne: /* todo */ break; // Jump if not equal
-        case ins_jgt: /* todo */ break; // Jump if greater than
-        case ins_jlt: /* todo */ break; // Jump if less than
-
-        // Subroutine operations
-        case ins_ret: // Return from subroutine
-            state->p = state->mem[state->r];
-            state->s = state->r - 2;
-            state->r = state->mem[state->s];
-            break;
-        case ins_cll: // Call subroutine
-            state->mem[state->s] = state->r;
-            state->s += 2;
-            state->mem[state->s] = state->p;
-            state->s += 2;
-            state->r = state->s - 2;
-            state->p = W();
-            break;
-        case ins_cla: // Call subroutine at an address in register
-            state->mem[state->s] = state->r;
-            state->s += 2;
-            state->mem[state->s] = state->p;
-            state->s += 2;
-            state->r = state->s - 2;
-            u16 m = state->regs[H()];
-            state->p = m;
-            break;
         default:
+            T();
             fprintf(stderr, "Bad Instruction %d\n", state->mem[state->p - 1]);
-            return;
+            return 1;
         }
     }
+bad_register:
+    T();
+    fprintf(stderr, "Bad Register %d\n", state->mem[state->p - 1]);
+    return 1;
+bad_target:
+    T();
+    fprintf(stderr, "Bad Target %.4X\n", state->p);
+    return 1;
+bad_stack:
+    T();
+    fprintf(stderr, "Stack Overflow %.4X\n", state->s);
+    return 1;
+bad_operand:
+    T();
+    fprintf(stderr, "Truncated Operand at %.4X\n", state->p);
+    return 1;
+#undef W
+#undef H
+#undef R
+#undef T
+#undef J
+#undef S
+#undef S_none
+#undef S_reg
+#undef S_byte
+#undef S_imm
+#undef S_mem
+#undef S_dst
+#undef S_stack
+#undef S_code
+#undef H_halt
+#undef H_nop
+#undef H_todo
+#undef H_todo_jump
+#undef H_store
+#undef H_load
+#undef H_from_a
+#undef H_to_a
+#undef H_set
+#undef H_ssp
+#undef H_push
+#undef H_pull
+#undef H_inc
+#undef H_dec
+#undef H_alu
+#undef H_alui
+#undef H_unary
+#undef H_cmp
+#undef H_cmpi
+#undef H_jmp
+#undef H_ret
+#undef H_cll
+#undef H_cla
+}
+
+// For images that were not verified (`-u`).
+int run(vm_t *state)
+{
+    return run_impl(state, 1);
+}
+
+// Only for images that passed `verify()`.
+int run_verified(vm_t *state)
+{
+    return run_impl(state, 0);
 }
 
 int main(int argc, char *argv[]) {
-    if(argc < 2) return usage(argv[0]), 1;
+    const char *trace_path = NULL;
+    u1 unverified = 0;
+    int a = 1;
+    for(; a < argc && argv[a][0] == '-'; ++a) {
+        /**/ if(strcmp(argv[a], "-t") == 0 && a + 1 < argc)
+            trace_path = argv[++a];
+        else if(strcmp(argv[a], "-u") == 0)
+            unverified = 1;
+        else
+            return usage(argv[0]), 1;
+    }
+    if(a >= argc) return usage(argv[0]), 1;
 
-    FILE *f = fopen(argv[1], "rb");
+    FILE *f = fopen(argv[a], "rb");
+    if(!f) {
+        fprintf(stderr, "Failed opening %s\n", argv[a]);
+        return 1;
+    }
     fseek(f, 0L, SEEK_END);
     long fsz = ftell(f);
     fseek(f, 0L, SEEK_SET);
@@ -192,10 +357,40 @@ int main(int argc, char *argv[]) {
     state.r = 0x1000;
     state.f = 0;
 
-    fread(state.mem + 0xA000, 1, fsz > 0x8000 ? 0x8000 : fsz, f);
+    u16 size = fread(state.mem + 0xA000, 1, fsz > 0x6000 ? 0x6000 : fsz, f);
     fclose(f);
 
-    run(&state);
+    if(!unverified && verify(&state, 0xA000, size) != 0) {
+        fprintf(stderr, "Rejected %s\n", argv[a]);
+        return 1;
+    }
+
+    if(trace_path) {
+        trace.fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(trace.fd < 0) {
+            fprintf(stderr, "Failed opening %s\n", trace_path);
+            return 1;
+        }
+        state.trace = &trace;
+        signal(SIGUSR1, trace_signal);
+        signal(SIGINT, trace_signal);
+        signal(SIGTERM, trace_signal);
+    }
+
+    int fault = unverified ? run(&state) : run_verified(&state);
+
+    // run() returns on halt and on every fault, both get dumped here.
+    // A snapshot signal must not interleave with this dump on the fd.
+    if(state.trace) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+        sigprocmask(SIG_BLOCK, &set, NULL);
+        trace_dump(state.trace);
+        close(trace.fd);
+    }
 
-    return state.regs[reg_a];
+    return fault ? 1 : state.regs[reg_a];
 }